@@ -0,0 +1,553 @@
+#ifndef METAFROG_PARALLEL_SWITCH_HEADER
+#define METAFROG_PARALLEL_SWITCH_HEADER
+
+#include "metafrog/template_switch.hpp"
+
+#include <boost/mpl/empty.hpp>
+#include <boost/mpl/size.hpp>
+#include <boost/mpl/front.hpp>
+#include <boost/mpl/pop_front.hpp>
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <iterator>
+#include <utility>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+namespace metafrog {
+
+/// What parallel_switch guarantees about the order in which
+/// records are handed to ::when and ::otherwise.
+enum class dispatch_order {
+  /// No guarantees at all; every (shard, case) bucket is an
+  /// independent task.
+  unordered,
+  /// Records belonging to the same case are processed in
+  /// input order (one after another, by a single thread).
+  /// Different cases still run concurrently, but no case
+  /// can start before every shard is sorted, at most
+  /// case_count()+1 threads can be busy at once (the others
+  /// sleep) and a single hot case runs serially on one
+  /// thread.
+  per_case
+};
+
+/// Apply a template_switch to large batches of tagged
+/// records using a pool of threads.
+///
+/// Calling a template_switch once per record means walking
+/// the list of cases once per record and jumping into
+/// a different ::when every time. parallel_switch instead
+/// splits the input into shards, sorts the records of each
+/// shard into one bucket per case and then calls the
+/// specialized ::when for a whole bucket in a tight loop.
+/// Sorting costs an extra pass over the input, so this only
+/// pays off when ::when does substantial work per record or
+/// when more than one core is available; for trivial cases
+/// on a single thread, calling the template_switch directly
+/// is faster.
+///
+/// ```
+/// struct record { int tag; double payload; };
+///
+/// struct handle_ : template_switch<handle_, void, int> {
+///   typedef template_switch<handle_, void, int> super;
+///   typedef super::cases_< 1, 2, 3 >::type cases;
+///
+///   template<int tag> static void when(record &r) { /* ... */ }
+///   static void otherwise(int tag, record &r) { /* ... */ }
+/// };
+///
+/// metafrog::parallel_switch<handle_> pool(8);
+/// pool.for_each(recs.begin(), recs.end(),
+///     [](const record &r) { return r.tag; });
+/// ```
+///
+/// Each record is passed (as an lvalue) as the only extra
+/// parameter to ::when and ::otherwise; the key function
+/// extracts the case from a record.
+///
+/// ## How it works
+///
+/// The threads are started once, in the constructor, and
+/// reused for each batch; the calling thread works as one
+/// of them.
+///
+/// 1. Shards of shard_size records are handed out to the
+///    threads. Each thread computes the case index of every
+///    record in its shard (using case_index) and performs
+///    a counting sort, yielding one bucket per case plus one
+///    bucket for unknown cases.
+/// 2. With dispatch_order::unordered, each non empty bucket
+///    immediately becomes a task in the queue of the thread
+///    that sorted it. With dispatch_order::per_case, the
+///    thread that sorts the last shard creates one task per
+///    case, spanning all the shards, and distributes them
+///    over the queues.
+/// 3. Threads take tasks from the back of their own queue;
+///    once it is empty they steal from the front of the
+///    other threads' queues. Threads that find no task
+///    sleep until new tasks are queued or the batch is done.
+///
+/// The key function is called exactly once per record.
+///
+/// If ::when, ::otherwise or the key function throw, the
+/// remaining tasks are skipped and the first exception is
+/// rethrown from for_each/transform. Records that have
+/// already been processed stay processed.
+///
+/// The parallel_switch object itself must not be used by
+/// multiple threads at once.
+///
+/// @tparam Switch A child class of template_switch
+template<typename Switch>
+class parallel_switch {
+public: // types
+
+  typedef Switch switch_type;
+  typedef typename switch_type::case_type case_type;
+  typedef typename switch_type::return_type return_type;
+
+public: // Construction
+
+  /// @param threads Total number of threads to use,
+  ///   including the calling thread. 0 means one thread
+  ///   per hardware thread.
+  /// @param shard_size Number of records sorted into
+  ///   buckets in one go. Smaller shards give better load
+  ///   balancing, larger ones less overhead.
+  explicit parallel_switch(size_t threads = 0, size_t shard_size = 4096)
+      : shard_size_( std::max<size_t>(shard_size, 1) ) {
+
+    if (threads == 0)
+      threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+
+    queues_.reset(new task_queue[threads]);
+    thread_count_ = threads;
+
+    try {
+      for (size_t id = 1; id < threads; id++)
+        threads_.emplace_back(&parallel_switch::worker, this, id);
+    } catch (...) {
+      // The destructor will not run; stop the threads that
+      // did start, or destroying them terminates
+      shutdown();
+      throw;
+    }
+  }
+
+  ~parallel_switch() {
+    shutdown();
+  }
+
+  parallel_switch(const parallel_switch&) = delete;
+  parallel_switch& operator=(const parallel_switch&) = delete;
+
+  /// Total number of threads used, including the caller
+  size_t threads() const { return thread_count_; }
+
+public: // Batch dispatch
+
+  /// Pass every record in [first, last) to
+  /// Switch::when<key(record)> (or ::otherwise); the return
+  /// values are discarded.
+  ///
+  /// @param first, last Random access range of records
+  /// @param key Called once with each record; must return
+  ///   the case_type of that record. Called concurrently.
+  template<typename Iter, typename KeyFn>
+  void for_each(Iter first, Iter last, KeyFn key,
+      dispatch_order order = dispatch_order::unordered) {
+    discard_sink<Iter> sink;
+    dispatch(first, last, key, sink, order);
+  }
+
+  /// Like for_each, but the return value for the record at
+  /// first[i] is stored in d_first[i]. The positions in the
+  /// output always correspond to the input, regardless of
+  /// the dispatch_order.
+  ///
+  /// @param d_first Random access output; must hold
+  ///   last - first elements.
+  template<typename Iter, typename OutIter, typename KeyFn>
+  void transform(Iter first, Iter last, OutIter d_first, KeyFn key,
+      dispatch_order order = dispatch_order::unordered) {
+    store_sink<Iter, OutIter> sink{ d_first };
+    dispatch(first, last, key, sink, order);
+  }
+
+private: // Detail: Sinks
+
+  // Sinks receive the result of each call; they are what
+  // distinguishes for_each from transform.
+
+  template<typename Iter>
+  struct discard_sink {
+    template<case_type Data>
+    inline void when(size_t idx METAFROG_ATTR_UNUSED, Iter rec) {
+      switch_type::template call_when<Data>(*rec);
+    }
+
+    inline void otherwise(size_t idx METAFROG_ATTR_UNUSED,
+        case_type data, Iter rec) {
+      switch_type::call_otherwise(data, *rec);
+    }
+  };
+
+  template<typename Iter, typename OutIter>
+  struct store_sink {
+    OutIter out;
+
+    template<case_type Data>
+    inline void when(size_t idx, Iter rec) {
+      out[idx] = switch_type::template call_when<Data>(*rec);
+    }
+
+    inline void otherwise(size_t idx, case_type data, Iter rec) {
+      out[idx] = switch_type::call_otherwise(data, *rec);
+    }
+  };
+
+private: // Detail: Buckets
+
+  /// The records of one shard, sorted by case.
+  /// order holds offsets relative to the start of the
+  /// input; bounds[c]..bounds[c+1] is the bucket of case c.
+  /// unknown holds the keys of the records in the bucket of
+  /// unknown cases (the last one), in the same order.
+  struct shard {
+    std::vector<size_t> order;
+    std::vector<size_t> bounds;
+    std::vector<size_t> case_of;
+    std::vector<case_type> unknown;
+  };
+
+  /// Sort the records first[begin..end) into buckets
+  template<typename Iter, typename KeyFn>
+  static void bucket(shard &sh, Iter first, size_t begin, size_t end,
+      KeyFn &key) {
+    const size_t buckets = switch_type::case_count() + 1;
+
+    sh.case_of.resize(end - begin);
+    sh.bounds.assign(buckets + 1, 0);
+    sh.unknown.clear();
+    for (size_t i = begin; i < end; i++) {
+      case_type data = key(first[i]);
+      size_t c = switch_type::case_index(data);
+      sh.case_of[i - begin] = c;
+      sh.bounds[c + 1]++;
+
+      // The scatter is stable, so these stay in the order
+      // of the unknown case's bucket
+      if (c == buckets - 1) sh.unknown.push_back(data);
+    }
+
+    for (size_t c = 1; c <= buckets; c++)
+      sh.bounds[c] += sh.bounds[c - 1];
+
+    // Scatter; uses bounds[c] as the insertion point and
+    // thereby shifts it to the end of the bucket…
+    sh.order.resize(end - begin);
+    for (size_t i = begin; i < end; i++)
+      sh.order[ sh.bounds[ sh.case_of[i - begin] ]++ ] = i;
+
+    // …so shift everything back again
+    for (size_t c = buckets; c > 0; c--)
+      sh.bounds[c] = sh.bounds[c - 1];
+    sh.bounds[0] = 0;
+  }
+
+  /// Run all records in a bucket through the case at
+  /// position case_idx. Finding the case happens once per
+  /// bucket, so the loop itself calls a single ::when.
+  template<bool CasesEmpty, typename Cases, size_t Index>
+  struct run_bucket {
+    template<typename Iter, typename Sink>
+    static inline void run(size_t case_idx, const size_t *b,
+        const size_t *e, Iter first, const case_type *unknown,
+        Sink &sink) {
+
+      using namespace boost::mpl;
+
+      if (case_idx == Index) {
+        for (; b != e; ++b)
+          sink.template when< front< Cases >::type::value >(*b, first + *b);
+      } else {
+        run_bucket<
+              size< Cases >::value == 1
+            , typename pop_front< Cases >::type
+            , Index + 1
+          >::run(case_idx, b, e, first, unknown, sink);
+      }
+    }
+  };
+
+  // The bucket of unknown cases; unknown holds the key of
+  // each record
+  template<typename Cases, size_t Index>
+  struct run_bucket<true, Cases, Index> {
+    template<typename Iter, typename Sink>
+    static inline void run(size_t case_idx METAFROG_ATTR_UNUSED,
+        const size_t *b, const size_t *e, Iter first,
+        const case_type *unknown, Sink &sink) {
+      for (; b != e; ++b, ++unknown)
+        sink.otherwise(*b, *unknown, first + *b);
+    }
+  };
+
+  typedef run_bucket<
+        boost::mpl::empty<typename switch_type::cases>::value
+      , typename switch_type::cases
+      , 0
+    > run_any_bucket;
+
+private: // Detail: Work stealing
+
+  /// A bucket of a single shard (unordered) or of all
+  /// shards (per_case; shard is ignored then)
+  struct task {
+    size_t shard;
+    size_t case_idx;
+  };
+
+  /// Each thread owns one of these; the owner pushes and
+  /// pops at the back, other threads steal from the front.
+  /// The padding keeps the members of neighbouring queues
+  /// at least one cache line apart.
+  struct task_queue {
+    std::mutex mtx;
+    std::deque<task> tasks;
+    char padding[64];
+  };
+
+  void push(size_t queue, task t) {
+    std::lock_guard<std::mutex> lock(queues_[queue].mtx);
+    queues_[queue].tasks.push_back(t);
+  }
+
+  bool pop_or_steal(size_t self, task &t) {
+    {
+      task_queue &q = queues_[self];
+      std::lock_guard<std::mutex> lock(q.mtx);
+      if (!q.tasks.empty()) {
+        t = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+      }
+    }
+
+    for (size_t off = 1; off < thread_count_; off++) {
+      task_queue &q = queues_[(self + off) % thread_count_];
+      std::lock_guard<std::mutex> lock(q.mtx);
+      if (!q.tasks.empty()) {
+        t = q.tasks.front();
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /// The state of a single call to dispatch
+  struct batch {
+    size_t size, shard_count;
+    std::atomic<size_t> next_shard{0}, shards_done{0}, pending{0};
+    std::atomic<bool> failed{false};
+    std::mutex error_mtx;
+    std::exception_ptr error;
+
+    /// Incremented (under pool_mtx_) whenever tasks are
+    /// queued or the batch may be finished
+    std::atomic<size_t> epoch{0};
+
+    void fail() {
+      std::lock_guard<std::mutex> lock(error_mtx);
+      if (!error) error = std::current_exception();
+      failed = true;
+    }
+
+    bool finished() const {
+      return shards_done == shard_count && pending == 0;
+    }
+  };
+
+  /// Wake up the threads sleeping in idle()
+  void signal(batch &b) {
+    {
+      std::lock_guard<std::mutex> lock(pool_mtx_);
+      b.epoch++;
+    }
+    work_.notify_all();
+  }
+
+  /// Sleep until signal() was called after seen was read
+  /// from b.epoch or the batch is finished
+  void idle(batch &b, size_t seen) {
+    std::unique_lock<std::mutex> lock(pool_mtx_);
+    work_.wait(lock, [&]() { return b.epoch != seen || b.finished(); });
+  }
+
+  template<typename Iter, typename KeyFn, typename Sink>
+  void dispatch(Iter first, Iter last, KeyFn &key, Sink &sink,
+      dispatch_order order) {
+    const size_t buckets = switch_type::case_count() + 1;
+
+    batch b;
+    b.size = std::distance(first, last);
+    // (Written this way so huge shard sizes do not overflow)
+    b.shard_count = b.size / shard_size_ + (b.size % shard_size_ != 0);
+    if (b.size == 0) return;
+
+    if (shards_.size() < b.shard_count) shards_.resize(b.shard_count);
+    if (order == dispatch_order::per_case) b.pending = buckets;
+
+    run_job([&](size_t self) {
+
+      // Sort shards into buckets
+      for (size_t s; (s = b.next_shard++) < b.shard_count;) {
+        shard &sh = shards_[s];
+        size_t begin = s * shard_size_;
+        size_t end = begin + std::min(shard_size_, b.size - begin);
+
+        try {
+          bucket(sh, first, begin, end, key);
+        } catch (...) {
+          b.fail();
+          sh.order.clear();
+          sh.unknown.clear();
+          sh.bounds.assign(buckets + 1, 0);
+        }
+
+        bool queued = false;
+        if (order == dispatch_order::unordered) {
+          for (size_t c = 0; c < buckets; c++) {
+            if (sh.bounds[c] == sh.bounds[c + 1]) continue;
+            b.pending++;
+            push(self, task{ s, c });
+            queued = true;
+          }
+        }
+
+        bool last = ++b.shards_done == b.shard_count;
+
+        // Every per-case task spans all shards, so they can
+        // only be created once the last shard is sorted
+        if (last && order == dispatch_order::per_case) {
+          for (size_t c = 0; c < buckets; c++)
+            push(c % thread_count_, task{ 0, c });
+          queued = true;
+        }
+
+        if (queued || last) signal(b);
+      }
+
+      // Process buckets
+      for (task t;;) {
+        size_t seen = b.epoch;
+        if (pop_or_steal(self, t)) {
+          if (!b.failed) {
+            try {
+              run_task(t, first, sink, order, b.shard_count);
+            } catch (...) {
+              b.fail();
+            }
+          }
+          if (--b.pending == 0) signal(b);
+        } else if (b.finished()) {
+          break;
+        } else {
+          idle(b, seen);
+        }
+      }
+    });
+
+    if (b.error) std::rethrow_exception(b.error);
+  }
+
+  template<typename Iter, typename Sink>
+  void run_task(task t, Iter first, Sink &sink,
+      dispatch_order order, size_t shard_count) {
+    size_t s = order == dispatch_order::per_case ? 0 : t.shard;
+    size_t s_end = order == dispatch_order::per_case ? shard_count : s + 1;
+
+    for (; s < s_end; s++) {
+      const shard &sh = shards_[s];
+      const size_t *data = sh.order.data();
+      run_any_bucket::run(t.case_idx,
+          data + sh.bounds[t.case_idx], data + sh.bounds[t.case_idx + 1],
+          first, sh.unknown.data(), sink);
+    }
+  }
+
+private: // Detail: Thread pool
+
+  /// Stop and join all threads
+  void shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(pool_mtx_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &t : threads_) t.join();
+  }
+
+  /// Run job on all threads (including the calling one)
+  /// and wait for all of them to return. job is given the
+  /// id of the thread it runs on.
+  void run_job(std::function<void(size_t)> job) {
+    {
+      std::lock_guard<std::mutex> lock(pool_mtx_);
+      job_ = std::move(job);
+      active_ = threads_.size();
+      generation_++;
+    }
+    wake_.notify_all();
+
+    job_(0);
+
+    std::unique_lock<std::mutex> lock(pool_mtx_);
+    done_.wait(lock, [this]() { return active_ == 0; });
+  }
+
+  void worker(size_t self) {
+    size_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(pool_mtx_);
+        wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+      }
+
+      job_(self);
+
+      std::lock_guard<std::mutex> lock(pool_mtx_);
+      if (--active_ == 0) done_.notify_one();
+    }
+  }
+
+  size_t shard_size_;
+  size_t thread_count_;
+  std::vector<shard> shards_;
+  std::unique_ptr<task_queue[]> queues_;
+
+  std::vector<std::thread> threads_;
+  std::mutex pool_mtx_;
+  std::condition_variable wake_, done_, work_;
+  std::function<void(size_t)> job_;
+  size_t generation_ = 0, active_ = 0;
+  bool stop_ = false;
+};
+
+} // namespace metafrog
+
+#endif
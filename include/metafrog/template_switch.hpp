@@ -9,6 +9,7 @@
 #include <boost/mpl/front.hpp>
 #include <boost/mpl/pop_front.hpp>
 
+#include <cstddef>
 #include <utility>
 #include <type_traits>
 #include <exception>
@@ -289,6 +290,41 @@ public: // call operator
         , std::forward<Args>(args)... );
   }
 
+public: // Direct access for drivers (see parallel_switch.hpp)
+
+  /// Number of cases in the list of cases
+  static constexpr size_t case_count() {
+    return boost::mpl::size<typename sub_type::cases>::value;
+  }
+
+  /// Position of data in the list of cases, using compare
+  /// just like the call operator does. If no case matches,
+  /// case_count() is returned.
+  static inline size_t case_index(case_type data) {
+    return index_of<
+          boost::mpl::empty<typename sub_type::cases>::value
+        , typename sub_type::cases
+        , 0
+      >::run(data);
+  }
+
+  /// Call ::when for a case that is already known; no
+  /// comparisons are performed.
+  template<case_type Data, typename... Args>
+  static inline return_type call_when(Args&&... args) {
+    return fitting_proxy::template when<Data, Args...>(
+        std::forward<Args>(args)... );
+  }
+
+  /// Call ::otherwise directly; no comparisons are
+  /// performed.
+  template<typename... Args>
+  static inline return_type call_otherwise(case_type data, Args&&... args) {
+    return fitting_proxy::template otherwise<Args...>(
+          std::forward<case_type>(data)
+        , std::forward<Args>(args)... );
+  }
+
 private: // Detail: Implementation
 
   /// Proxy for calling the child's ::when and ::otherwise.
@@ -382,6 +418,33 @@ private: // Detail: Implementation
     }
   };
 
+  /// Like match, but yields the position of the matching
+  /// case instead of calling it.
+  template<bool CasesEmpty, typename Cases, size_t Index>
+  struct index_of {
+    static inline size_t run(case_type data) {
+
+      using namespace boost::mpl;
+
+      if ( sub_type::compare(front< Cases >::type::value, data) )
+        return Index;
+      else
+        return index_of<
+              size< Cases >::value == 1
+            , typename pop_front< Cases >::type
+            , Index + 1
+          >::run(data);
+    }
+  };
+
+  // No match found
+  template<typename Cases, size_t Index>
+  struct index_of<true, Cases, Index> {
+    static inline size_t run(case_type data METAFROG_ATTR_UNUSED) {
+      return Index;
+    }
+  };
+
 };
 
 } // namespace metafrog
@@ -0,0 +1,107 @@
+// Measures how parallel_switch scales with the number of
+// threads.
+//
+// Usage: parallel_switch_bench [records] [max threads]
+//
+// Runs the same batch of randomly tagged records through
+// a plain template_switch (one call per record) and through
+// parallel_switch with 1 up to max threads (both dispatch
+// orders), printing the throughput and the speedup relative
+// to the plain template_switch.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "metafrog/parallel_switch.hpp"
+
+using metafrog::template_switch;
+using metafrog::parallel_switch;
+using metafrog::dispatch_order;
+
+struct record {
+  uint32_t tag;
+  uint32_t payload;
+};
+
+// Some arithmetic that depends on the case, so each ::when
+// is really a different function
+struct handle_ : template_switch<handle_, uint64_t, uint32_t> {
+  typedef template_switch<handle_, uint64_t, uint32_t> super;
+  typedef super::cases_<0, 1, 2, 3, 5, 8, 13, 21,
+                        34, 55, 89, 144, 233, 377, 610, 987>::type cases;
+
+  template<uint32_t data> static inline uint64_t when(const record &r) {
+    uint64_t x = r.payload;
+    for (uint32_t i = 0; i < 8; i++)
+      x = x * (2 * data + 1) + (x >> (data % 13 + 1));
+    return x;
+  }
+
+  static inline uint64_t otherwise(uint32_t data, const record &r) {
+    return data ^ r.payload;
+  }
+} handle;
+
+static uint32_t record_tag(const record &r) {
+  return r.tag;
+}
+
+template<typename Fn>
+static double seconds(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  return d.count();
+}
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1 << 23;
+  size_t max_threads = argc > 2 ? std::strtoull(argv[2], nullptr, 10)
+                                : std::thread::hardware_concurrency();
+  if (max_threads == 0) max_threads = 1;
+
+  static const uint32_t tags[] = {0, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89,
+                                  144, 233, 377, 610, 987, 4242};
+  std::mt19937 rng(23);
+  std::uniform_int_distribution<size_t> pick(0, sizeof(tags)/sizeof(*tags) - 1);
+  std::vector<record> recs(count);
+  for (auto &r : recs) r = record{ tags[pick(rng)], (uint32_t)rng() };
+
+  std::vector<uint64_t> out(count), expected(count);
+
+  double base = seconds([&]() {
+    for (size_t i = 0; i < count; i++)
+      expected[i] = handle(recs[i].tag, recs[i]);
+  });
+  std::printf("%-10s %8s %14s %8s\n", "order", "threads", "records/s", "speedup");
+  std::printf("%-10s %8d %14.0f %8.2f\n", "serial", 1, count / base, 1.0);
+
+  for (size_t threads = 1; threads <= max_threads; threads++) {
+    parallel_switch<handle_> pool(threads);
+
+    for (auto order : {dispatch_order::unordered, dispatch_order::per_case}) {
+      // Warm up (allocates the shards)
+      pool.transform(recs.begin(), recs.end(), out.begin(), record_tag, order);
+
+      double t = seconds([&]() {
+        pool.transform(recs.begin(), recs.end(), out.begin(), record_tag, order);
+      });
+
+      if (out != expected) {
+        std::fprintf(stderr, "parallel_switch produced wrong results\n");
+        return 1;
+      }
+
+      std::printf("%-10s %8zu %14.0f %8.2f\n",
+          order == dispatch_order::unordered ? "unordered" : "per_case",
+          threads, count / t, base / t);
+    }
+  }
+
+  return 0;
+}
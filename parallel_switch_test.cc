@@ -0,0 +1,221 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <vector>
+#include <atomic>
+#include <limits>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+
+#include "metafrog/parallel_switch.hpp"
+
+using metafrog::template_switch;
+using metafrog::parallel_switch;
+using metafrog::dispatch_order;
+
+struct record {
+  int tag;
+  int payload;
+  int seen;
+};
+
+static int record_tag(const record &r) {
+  return r.tag;
+}
+
+// Builds count records with tags cycling through tags
+static std::vector<record> make_records(size_t count,
+    const std::vector<int> &tags) {
+  std::vector<record> recs(count);
+  for (size_t i = 0; i < count; i++)
+    recs[i] = record{ tags[(i * 7) % tags.size()], (int)i, 0 };
+  return recs;
+}
+
+// Case Index Test /////////////////////////////////////////
+// case_index yields the position of the first matching case
+
+struct index_ : template_switch<index_, int, int> {
+  typedef template_switch<index_, int, int> super;
+  typedef super::cases_<5, -3, 5, 7>::type cases;
+
+  template<int data> static int when() {
+    return data;
+  }
+
+} index_case;
+
+TEST(ParallelSwitchTest, CaseIndex) {
+  ASSERT_EQ( index_::case_count(), (size_t)4);
+  ASSERT_EQ( index_::case_index(5),  (size_t)0);
+  ASSERT_EQ( index_::case_index(-3), (size_t)1);
+  ASSERT_EQ( index_::case_index(7),  (size_t)3);
+  ASSERT_EQ( index_::case_index(8),  (size_t)4);
+  ASSERT_EQ( index_::call_when<7>(), 7);
+  ASSERT_THROW( index_::call_otherwise(8), metafrog::unknown_case);
+};
+
+// Transform Test //////////////////////////////////////////
+// Results land at the position of their record, for each
+// dispatch order and a range of thread counts.
+
+struct transform_ : template_switch<transform_, int, int> {
+  typedef template_switch<transform_, int, int> super;
+  typedef super::cases_<1, 2, 3, 40>::type cases;
+
+  template<int data> static int when(const record &r) {
+    return data * 1000 + r.payload;
+  }
+
+  static int otherwise(int data, const record &r) {
+    return -data - r.payload;
+  }
+
+};
+
+TEST(ParallelSwitchTest, Transform) {
+  auto recs = make_records(10007, {1, 2, 3, 40, 99});
+
+  for (size_t threads : {1, 2, 5}) {
+    parallel_switch<transform_> pool(threads, 64);
+    ASSERT_EQ( pool.threads(), threads);
+
+    for (auto order : {dispatch_order::unordered, dispatch_order::per_case}) {
+      std::vector<int> out(recs.size());
+      pool.transform(recs.begin(), recs.end(), out.begin(), record_tag, order);
+
+      for (size_t i = 0; i < recs.size(); i++)
+        ASSERT_EQ( out[i], transform_()(recs[i].tag, recs[i]) );
+    }
+  }
+};
+
+TEST(ParallelSwitchTest, HugeShards) {
+  auto recs = make_records(5, {1, 2, 99});
+  parallel_switch<transform_> pool(2, std::numeric_limits<size_t>::max());
+
+  for (auto order : {dispatch_order::unordered, dispatch_order::per_case}) {
+    std::vector<int> out(recs.size(), 12345);
+    pool.transform(recs.begin(), recs.end(), out.begin(), record_tag, order);
+
+    for (size_t i = 0; i < recs.size(); i++)
+      ASSERT_EQ( out[i], transform_()(recs[i].tag, recs[i]) );
+  }
+};
+
+TEST(ParallelSwitchTest, Empty) {
+  parallel_switch<transform_> pool(3);
+  std::vector<record> recs;
+  std::vector<int> out;
+  pool.transform(recs.begin(), recs.end(), out.begin(), record_tag);
+};
+
+// For Each Test ///////////////////////////////////////////
+// Every record is visited exactly once; with per_case
+// ordering, each case sees its records in input order.
+
+struct visit_ : template_switch<visit_, void, int> {
+  typedef template_switch<visit_, void, int> super;
+  typedef super::cases_<10, 20, 30>::type cases;
+
+  static std::atomic<int> last_payload[3];
+  static std::atomic<bool> out_of_order;
+
+  template<int data> static void when(record &r) {
+    r.seen++;
+    auto &last = last_payload[data / 10 - 1];
+    if (last.exchange(r.payload) > r.payload)
+      out_of_order = true;
+  }
+
+  static void otherwise(int data METAFROG_ATTR_UNUSED, record &r) {
+    r.seen += 100;
+  }
+
+};
+
+std::atomic<int> visit_::last_payload[3];
+std::atomic<bool> visit_::out_of_order;
+
+TEST(ParallelSwitchTest, ForEachPerCase) {
+  auto recs = make_records(20000, {10, 20, 30, 0});
+  for (auto &l : visit_::last_payload) l = -1;
+  visit_::out_of_order = false;
+
+  parallel_switch<visit_> pool(4, 100);
+  pool.for_each(recs.begin(), recs.end(), record_tag,
+      dispatch_order::per_case);
+
+  ASSERT_FALSE( visit_::out_of_order );
+  for (auto &r : recs)
+    ASSERT_EQ( r.seen, r.tag == 0 ? 100 : 1 );
+};
+
+TEST(ParallelSwitchTest, ForEachUnordered) {
+  auto recs = make_records(20000, {10, 20, 30, 0});
+
+  parallel_switch<visit_> pool(4, 100);
+  pool.for_each(recs.begin(), recs.end(), record_tag);
+  pool.for_each(recs.begin(), recs.end(), record_tag);
+
+  for (auto &r : recs)
+    ASSERT_EQ( r.seen, r.tag == 0 ? 200 : 2 );
+};
+
+TEST(ParallelSwitchTest, KeyCalledOnce) {
+  auto recs = make_records(5000, {10, 20, 30, 0, 5});
+  std::atomic<size_t> calls{0};
+  auto key = [&](const record &r) {
+    calls++;
+    return r.tag;
+  };
+
+  parallel_switch<visit_> pool(3, 64);
+  for (auto order : {dispatch_order::unordered, dispatch_order::per_case}) {
+    calls = 0;
+    pool.for_each(recs.begin(), recs.end(), key, order);
+    ASSERT_EQ( calls, recs.size() );
+  }
+
+  for (auto &r : recs)
+    ASSERT_EQ( r.seen, r.tag == 0 || r.tag == 5 ? 200 : 2 );
+};
+
+// Exception Test //////////////////////////////////////////
+// Exceptions are rethrown in the calling thread and the
+// pool stays usable.
+
+struct throwing_ : template_switch<throwing_, int, int> {
+  typedef template_switch<throwing_, int, int> super;
+  typedef super::cases_<1, 2>::type cases;
+
+  template<int data> static int when(const record &r METAFROG_ATTR_UNUSED) {
+    return data;
+  }
+
+};
+
+TEST(ParallelSwitchTest, Exceptions) {
+  parallel_switch<throwing_> pool(3, 16);
+  std::vector<int> out(1000);
+
+  auto bad = make_records(1000, {1, 2, 3});
+  ASSERT_THROW(
+      pool.transform(bad.begin(), bad.end(), out.begin(), record_tag)
+    , metafrog::unknown_case);
+
+  ASSERT_THROW(
+      pool.transform(bad.begin(), bad.end(), out.begin(),
+        [](const record &r) -> int {
+          if (r.payload == 500) throw std::runtime_error("key");
+          return r.tag == 3 ? 1 : r.tag;
+        })
+    , std::runtime_error);
+
+  auto good = make_records(1000, {1, 2});
+  pool.transform(good.begin(), good.end(), out.begin(), record_tag);
+  for (size_t i = 0; i < good.size(); i++)
+    ASSERT_EQ( out[i], good[i].tag );
+};
@@ -0,0 +1,352 @@
+// Differential fuzzer for the dispatch strategies.
+//
+// Every way of dispatching a value to a case must give the
+// same result as a naive linear scan over the list of cases
+// (first case for which compare(case, key) holds wins):
+//
+// * template_switch::operator() (the recursive match)
+// * case_index() followed by call_otherwise()
+// * parallel_switch::transform() with each dispatch_order
+//
+// The lists of cases are generated pseudo randomly at
+// compile time, biased towards boundary values (minimum,
+// maximum, 0, -1, 1) and duplicates. The keys are taken
+// from the fuzzer input and are biased towards boundary
+// values and the neighbours of each case (so size_t
+// wraparound and INT_MIN/INT_MAX are covered).
+//
+// Build with -DMETAFROG_LIBFUZZER and -fsanitize=fuzzer to
+// get a libFuzzer target (make template_switch_libfuzzer).
+// Otherwise this is a standalone program feeding random
+// inputs:
+//
+//   template_switch_fuzz [iterations] [seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <array>
+#include <limits>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "metafrog/template_switch.hpp"
+#include "metafrog/parallel_switch.hpp"
+
+using metafrog::template_switch;
+using metafrog::parallel_switch;
+using metafrog::dispatch_order;
+
+// Values //////////////////////////////////////////////////
+
+/// Reinterpret any case value as unsigned, so arithmetic on
+/// it wraps instead of overflowing.
+template<typename T>
+constexpr typename std::make_unsigned<T>::type to_unsigned(T v) {
+  return static_cast<typename std::make_unsigned<T>::type>(v);
+}
+
+/// n-th value of a 64 bit LCG, mixed a little
+constexpr uint64_t nth_random(uint64_t seed, size_t n) {
+  uint64_t x = seed;
+  for (size_t i = 0; i <= n; i++)
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+  return x ^ (x >> 29);
+}
+
+/// A value of T derived from r; mostly boundary values
+/// and small numbers (which makes duplicates likely)
+template<typename T>
+constexpr T interesting_value(uint64_t r) {
+  typedef std::numeric_limits<T> lim;
+  switch (r % 8) {
+    case 0:  return lim::min();
+    case 1:  return lim::max();
+    case 2:  return T(0);
+    case 3:  return static_cast<T>(to_unsigned(T(0)) - 1u);
+    case 4:  return T(1);
+    case 5:  return static_cast<T>(lim::min() + T(1));
+    case 6:  return static_cast<T>((r >> 8) % 16);
+    default: return static_cast<T>(r >> 8);
+  }
+}
+
+/// Mixes a case value into the result of ::when and
+/// ::otherwise, so different cases give different results
+template<typename T>
+constexpr uint64_t mix(T v, uint64_t salt) {
+  return (static_cast<uint64_t>(to_unsigned(v)) + salt) * 0x9E3779B97F4A7C15ull;
+}
+
+// Switches ////////////////////////////////////////////////
+
+/// What the switches are given as extra parameter
+template<typename T>
+struct record {
+  T key;
+  uint64_t salt;
+};
+
+/// ::when and ::otherwise shared by all switches under test.
+/// otherwise() subtracts one like the otherwise_ test does,
+/// which wraps around for 0 and the minimum.
+template<typename Sub, typename T>
+struct fuzz_base_ : template_switch<Sub, uint64_t, T> {
+
+  template<T data> static uint64_t when(const record<T> &r) {
+    return mix(data, r.salt);
+  }
+
+  static uint64_t otherwise(T data, const record<T> &r) {
+    return ~mix(static_cast<T>(to_unsigned(data) - 1u), r.salt);
+  }
+
+};
+
+/// The default compare
+struct equal_cmp {
+  template<typename T>
+  static constexpr bool apply(T a, T b) {
+    return a == b;
+  }
+};
+
+/// Custom compare; many values match each case
+struct mod7_cmp {
+  template<typename T>
+  static constexpr bool apply(T a, T b) {
+    return to_unsigned(a) % 7 == to_unsigned(b) % 7;
+  }
+};
+
+/// Custom compare that is not symmetric; makes sure
+/// compare(case, key) is called in that order
+struct less_equal_cmp {
+  template<typename T>
+  static constexpr bool apply(T a, T b) {
+    return a <= b;
+  }
+};
+
+/// Switch relying on the default compare
+template<typename T, T... Cases>
+struct plain_switch_ : fuzz_base_<plain_switch_<T, Cases...>, T> {
+  typedef fuzz_base_<plain_switch_<T, Cases...>, T> super;
+  typedef typename super::template cases_<Cases...>::type cases;
+  typedef equal_cmp reference_compare;
+  static constexpr std::array<T, sizeof...(Cases)> case_list{{ Cases... }};
+};
+
+template<typename T, T... Cases>
+constexpr std::array<T, sizeof...(Cases)> plain_switch_<T, Cases...>::case_list;
+
+/// Switch with a custom compare
+template<typename Compare, typename T, T... Cases>
+struct custom_switch_ : fuzz_base_<custom_switch_<Compare, T, Cases...>, T> {
+  typedef fuzz_base_<custom_switch_<Compare, T, Cases...>, T> super;
+  typedef typename super::template cases_<Cases...>::type cases;
+  typedef Compare reference_compare;
+  static constexpr std::array<T, sizeof...(Cases)> case_list{{ Cases... }};
+
+  static constexpr bool compare(T a, T b) {
+    return Compare::apply(a, b);
+  }
+};
+
+template<typename Compare, typename T, T... Cases>
+constexpr std::array<T, sizeof...(Cases)>
+  custom_switch_<Compare, T, Cases...>::case_list;
+
+/// Instantiate a switch with Count cases generated from Seed.
+/// Compare = void uses the default compare.
+template<typename Compare, typename T, uint64_t Seed, typename Seq>
+struct random_switch_impl;
+
+template<typename T, uint64_t Seed, size_t... I>
+struct random_switch_impl<void, T, Seed, std::index_sequence<I...>> {
+  typedef plain_switch_<T, interesting_value<T>(nth_random(Seed, I))...> type;
+};
+
+template<typename Compare, typename T, uint64_t Seed, size_t... I>
+struct random_switch_impl<Compare, T, Seed, std::index_sequence<I...>> {
+  typedef custom_switch_<Compare, T,
+      interesting_value<T>(nth_random(Seed, I))...> type;
+};
+
+// Note that boost::mpl::vector is limited to 20 elements
+template<typename Compare, typename T, uint64_t Seed, size_t Count>
+using random_switch = typename random_switch_impl<
+    Compare, T, Seed, std::make_index_sequence<Count> >::type;
+
+// Checking ////////////////////////////////////////////////
+
+/// Reads values from the fuzzer input; yields zeros once
+/// the input is exhausted.
+struct input_reader {
+  const uint8_t *data;
+  size_t size;
+
+  bool empty() const { return size == 0; }
+
+  uint64_t next(size_t bytes) {
+    uint64_t r = 0;
+    for (; bytes > 0 && size > 0; bytes--, size--, data++)
+      r = (r << 8) | *data;
+    return r;
+  }
+};
+
+template<typename T>
+static void report(const char *strategy, const char *sw, T key,
+    uint64_t expected, uint64_t got) {
+  std::fprintf(stderr, "%s disagrees with the reference\n"
+      "  switch:   %s\n  key:      %llu (as unsigned)\n"
+      "  expected: %llu\n  got:      %llu\n",
+      strategy, sw, (unsigned long long)to_unsigned(key),
+      (unsigned long long)expected, (unsigned long long)got);
+  std::abort();
+}
+
+template<typename Switch>
+struct checker {
+  typedef typename Switch::case_type case_type;
+  typedef record<case_type> record_type;
+
+  /// The naive reference: index of the first case that
+  /// compares equal
+  static size_t reference_index(case_type key) {
+    for (size_t i = 0; i < Switch::case_list.size(); i++)
+      if (Switch::reference_compare::apply(Switch::case_list[i], key))
+        return i;
+    return Switch::case_list.size();
+  }
+
+  static uint64_t reference(const record_type &r) {
+    size_t i = reference_index(r.key);
+    if (i < Switch::case_list.size())
+      return mix(Switch::case_list[i], r.salt);
+    return ~mix(static_cast<case_type>(to_unsigned(r.key) - 1u), r.salt);
+  }
+
+  /// Keys are: random, a neighbour of a case or a boundary
+  static case_type make_key(input_reader &in) {
+    uint64_t sel = in.next(1), raw = in.next(sizeof(case_type));
+    const auto &cases = Switch::case_list;
+    switch (sel % 4) {
+      case 0: return static_cast<case_type>(raw);
+      case 1:
+        if (cases.empty()) return static_cast<case_type>(raw);
+        return static_cast<case_type>(
+            to_unsigned(cases[raw % cases.size()]) + (sel >> 2) % 3 - 1u);
+      default:
+        return interesting_value<case_type>(raw);
+    }
+  }
+
+  static void run(input_reader in) {
+    static parallel_switch<Switch> pool(2, 5);
+    const char *name = __PRETTY_FUNCTION__;
+
+    std::vector<record_type> recs;
+    do {
+      case_type key = make_key(in);
+      recs.push_back(record_type{ key, in.next(2) });
+    } while (!in.empty() && recs.size() < 256);
+
+    Switch sw;
+    std::vector<uint64_t> expected(recs.size());
+    for (size_t i = 0; i < recs.size(); i++) {
+      const record_type &r = recs[i];
+      expected[i] = reference(r);
+
+      uint64_t got = sw(r.key, r);
+      if (got != expected[i])
+        report("template_switch::operator()", name, r.key, expected[i], got);
+
+      size_t idx = Switch::case_index(r.key);
+      if (idx != reference_index(r.key))
+        report("template_switch::case_index", name, r.key,
+            reference_index(r.key), idx);
+
+      if (idx == Switch::case_count()) {
+        got = Switch::call_otherwise(r.key, r);
+        if (got != expected[i])
+          report("template_switch::call_otherwise", name, r.key,
+              expected[i], got);
+      }
+    }
+
+    auto key = [](const record_type &r) { return r.key; };
+    for (auto order : {dispatch_order::unordered, dispatch_order::per_case}) {
+      std::vector<uint64_t> out(recs.size());
+      pool.transform(recs.begin(), recs.end(), out.begin(), key, order);
+      for (size_t i = 0; i < recs.size(); i++)
+        if (out[i] != expected[i])
+          report(order == dispatch_order::unordered
+                ? "parallel_switch (unordered)" : "parallel_switch (per_case)",
+              name, recs[i].key, expected[i], out[i]);
+    }
+  }
+};
+
+/// Run the input through one switch; which one is selected
+/// by the first byte.
+template<typename... Switches>
+struct check_one_of {
+  static void run(const uint8_t *data, size_t size) {
+    typedef void (*check_fn)(input_reader);
+    static const check_fn checks[] = { &checker<Switches>::run... };
+
+    input_reader in{ data, size };
+    size_t which = in.next(1) % sizeof...(Switches);
+    checks[which](in);
+  }
+};
+
+typedef check_one_of<
+    random_switch<void, int, 1, 0>
+  , random_switch<void, int, 2, 1>
+  , random_switch<void, int, 3, 4>
+  , random_switch<void, int, 4, 11>
+  , random_switch<void, int, 5, 20>
+  , random_switch<void, size_t, 6, 3>
+  , random_switch<void, size_t, 7, 20>
+  , random_switch<void, int8_t, 8, 20>
+  , random_switch<void, uint16_t, 9, 12>
+  , random_switch<void, int64_t, 10, 17>
+  , random_switch<mod7_cmp, int, 11, 5>
+  , random_switch<mod7_cmp, size_t, 12, 13>
+  , random_switch<less_equal_cmp, int, 13, 8>
+  , random_switch<less_equal_cmp, int64_t, 14, 20>
+  > all_checks;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  all_checks::run(data, size);
+  return 0;
+}
+
+#ifndef METAFROG_LIBFUZZER
+int main(int argc, char **argv) {
+  unsigned long long iterations =
+    argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+  unsigned long long seed =
+    argc > 2 ? std::strtoull(argv[2], nullptr, 10) : std::random_device()();
+
+  std::printf("template_switch_fuzz: %llu iterations, seed %llu\n",
+      iterations, seed);
+
+  std::mt19937_64 rng(seed);
+  std::vector<uint8_t> input;
+  for (unsigned long long i = 0; i < iterations; i++) {
+    input.resize(rng() % 512);
+    for (auto &b : input) b = static_cast<uint8_t>(rng());
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+
+  return 0;
+}
+#endif